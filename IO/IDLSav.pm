@@ -15,7 +15,7 @@ PDL::IO::IDLSav allows you to read and write IDL data files.
     use Exporter ();
     package PDL::IO::IDLSav;
     @ISA = ( Exporter );
-    @EXPORT_OK = qw( ridl );
+    @EXPORT_OK = qw( ridl ridl_index ridl_var ridl_heap );
     @EXPORT = @EXPORT_OK;
     @EXPORT_TAGS = ( Func=>[@EXPORT_OK] );
     
@@ -30,6 +30,8 @@ PDL::IO::IDLSav allows you to read and write IDL data files.
 =for usage 
 
 $a = ridl("foo.sav");
+$a = ridl("foo.sav", {vars=>['IMAGE','TIMES']});
+$a = ridl("foo.sav", {lazy=>1});
 
 =for ref 
 
@@ -41,11 +43,32 @@ that are present in the save file.
 Because IDL identifiers can't contain special characters, some fields that
 start with '+' are used to store metadata about the file itself.
 
+With the "vars" option, only the named variables are decoded (via
+L<ridl_index|ridl_index> and L<ridl_var|ridl_var>); the rest of the
+file is never read.  With the "lazy" option you get back a tied hash
+that has every variable name in it but decodes each variable only when
+you first look at it.
+
 =cut
 
 
 sub ridl {
   my( $name ) = shift;
+  my $opt = shift;
+
+  if(ref($opt) eq 'HASH' and ($opt->{vars} or $opt->{lazy})) {
+    my $idx = ridl_index($name);
+    if($opt->{lazy}) {
+      my %h;
+      tie %h, 'PDL::IO::IDLSav::Lazy', $idx;
+      return \%h;
+    }
+    my $out = {"+meta" => $idx->{"+meta"}};
+    for my $v(@{$opt->{vars}}) {
+      $out->{uc $v} = ridl_var($idx, $v);
+    }
+    return $out;
+  }
   
   open(IDLSAV,"<$name") || barf("ridl: Can't open `$name' for reading\n");
   
@@ -78,7 +101,7 @@ our $types = [ ['START_MARKER',undef]     # 0      (start of SAVE file)
 	      ,['VERSION',\&r_v]          # 14     (IDL Version information)
 	      ,['HEAP_HEADER',undef]      # 15     (Heap index information)
 	      ,['HEAP_DATA',undef]        # 16     (Heap data)
-	      ,['PROMOTE64',\&r_p64]      # 17     (Starts 64-bit file offsets)
+	      ,['PROMOTE64',\&r_64]       # 17     (Starts 64-bit file offsets)
 	      ];
 
 #
@@ -167,25 +190,14 @@ sub read_records {
     ### Hack to set 64-bit file offsets BEFORE recording the next seek entry
     
     if($type==17) {
-      r_p64($hash);
+      r_64($hash);
     }
     
     ### Record the next seek location
-    ### (and discard 8 more bytes)
-    ###
-    ### (Fix this with a 64-bit PDL snarf like in r_n_pdl, below)
+    ### (and discard 4 more bytes)
     
-    my $next;
-    if($hash->{'+64'}) {
-      sysread(IDLSAV,$buf,8 + 8);
-      my @next = unpack "NN",$buf;
-      $next = ($little_endian) ? 
-	($next[0] + 2**32 * $next[1]) : 
-	($next[1] + 2**32 * $next[0]);
-    } else {
-      sysread(IDLSAV,$buf,4 + 8);
-      $next = unpack "N",$buf;
-    }
+    sysread(IDLSAV,$buf,rec_hdr_len());
+    my $next = rec_next($buf);
     
     ### Infinite-loop detector
 
@@ -217,6 +229,24 @@ sub read_records {
 
 
 
+##############################
+# rec_hdr_len, rec_next
+#
+# The rest of a record header after the type: NEXTREC as two unsigned
+# big-endian longs, low word first, and 4 bytes we don't use.  The header
+# is 16 bytes whether or not there's been a PROMOTE64 record; in files
+# under 4GB the high word is just 0.  (That's the layout of the save
+# files IDL itself writes, and what scipy's readsav reads.)  Shared by
+# read_records and ridl_index.
+
+sub rec_hdr_len { 12 }
+
+sub rec_next {
+  my ($lo,$hi) = unpack "NN", shift;
+  return $lo + 2**32 * $hi;
+}
+
+
 ##############################
 # r_end
 #
@@ -317,6 +347,7 @@ sub r_var {
   if((($flags & 4) == 0)  and  (($flags & 32) == 0)) {
       print "it's a scalar\n";
       ## Scalar case
+      r_datastart($name);
       $hash->{$name} = 
 	  &{$vtypes->[$type]->[1]}
               ([],   @{$vtypes->[$type]->[2]})
@@ -328,6 +359,7 @@ sub r_var {
       if(($flags & 32) == 0) {
 	  ## Simple array case
 	  print "simple array...\n";
+	  r_datastart($name);
 
 	  my @args= ([ @{$arrdesc->{dims}}[0..$arrdesc->{ndims}-1]], 
 		     @{$vtypes->[$type]->[2]});
@@ -349,6 +381,19 @@ sub r_var {
 }
   
 
+##############################
+# r_datastart
+#
+# Variable data starts with a long 7 (START_DATA); skip it.
+sub r_datastart {
+  my $name = shift;
+  my $buf;
+  sysread(IDLSAV,$buf,4);
+  my $seven = unpack "N",$buf;
+  print STDERR "ridl: expected data-start key (7) for $name but got $seven\n" 
+    if($seven != 7);
+}
+
 ######################################################################
 ######################################################################
 
@@ -511,6 +556,416 @@ sub r_strvar {
 }
 
 
+######################################################################
+######################################################################
+##
+## Indexed reader.
+##
+## ridl_index walks the record chain once, reading only record headers
+## and variable descriptors, and notes where each variable's (and each
+## heap value's) data starts.  ridl_var / ridl_heap then decode just the
+## one value.  Numeric arrays are pulled straight out of a memory map of
+## the file by idlsav_read_helper (below), which byte-swaps as it copies,
+## so only the pages of the file that hold the requested data are ever
+## touched.
+##
+
+=head2 ridl_index
+
+=for usage
+
+$idx = ridl_index("foo.sav");
+
+=for ref
+
+Index an IDL save file without reading any of its data.
+
+You get back a hash ref with the file name, the "+meta" information
+(as for L<ridl|ridl>), a "vars" hash describing each variable (type,
+dimensions, and where its data lives in the file), and a "heap" hash
+doing the same for each heap value, indexed by heap number.  Pass it
+to L<ridl_var|ridl_var> or L<ridl_heap|ridl_heap> to get at the data.
+
+Indexing costs one short read per record, so it is fast even for
+multi-gigabyte files.
+
+=cut
+
+# IDL type code => [PDL type, bytes per element in the file, offset of
+# the value within each element, leading bytes before array data].
+# 16-bit values are stored in 32-bit slots; byte arrays carry a length.
+our $idx_types = {
+   1 => [byte,     1, 0, 4]
+  ,2 => [short,    4, 2, 0]
+  ,3 => [long,     4, 0, 0]
+  ,4 => [float,    4, 0, 0]
+  ,5 => [double,   8, 0, 0]
+  ,6 => [float,    4, 0, 0]       # complex: (re,im) pairs
+  ,9 => [double,   8, 0, 0]       # double complex
+  ,12=> [ushort,   4, 2, 0]
+  ,13=> [long,     4, 0, 0]       # unsigned -- read into long
+  ,14=> [longlong, 8, 0, 0]
+  ,15=> [longlong, 8, 0, 0]       # unsigned -- read into longlong
+};
+
+sub ridl_index {
+  my $name = shift;
+  my $us = "ridl_index";
+  local *IDX;
+
+  open(IDX,"<$name") || barf("$us: Can't open `$name' for reading\n");
+  my $size = -s IDX;
+
+  my $buf;
+  sysread(IDX,$buf,4) || barf("$us: Couldn't read preamble\n");
+  barf("$us: $name isn't an IDL save file (wrong magic)\n")
+    unless(substr($buf,0,2) eq 'SR');
+
+  my $idx = { file => $name, size => $size, "+meta" => {}, vars => {}, heap => {}, order => [] };
+
+  my $rd = sub { my $b; sysread(IDX,$b,$_[0]) == $_[0] || barf("$us: unexpected EOF in $name\n"); $b };
+  my $long = sub { unpack "N", &$rd(4) };
+  my $str = sub { my $len = &$long; my $plen = $len - ($len % -4); unpack "A$len", &$rd($plen) };
+
+  # Type descriptor and (for arrays) array descriptor, up to the start of data.
+  my $desc = sub {
+    my $d = {};
+    ($d->{type}, $d->{flags}) = unpack "NN", &$rd(8);
+    if($d->{flags} & 32) {
+      $d->{struct} = 1;
+      return $d;
+    }
+    if($d->{flags} & 4) {
+      my $arrstart = &$long;
+      my ($nelem, $ndims, @dims);
+      if($arrstart == 18) {
+	my @v = unpack "N"x6, &$rd(24);        # skip, skip, nbytes, nelem (64-bit)
+	$nelem = $v[5] + 2**32 * $v[4];
+	$ndims = &$long;
+	&$rd(8);
+	my @dd = unpack "N"x16, &$rd(64);
+	@dims = map { $dd[2*$_+1] } (0..7);
+      } else {
+	my @v = unpack "N"x7, &$rd(28);        # skip, nbytes, nelem, ndims, skip, skip, nmax
+	$nelem = $v[2];
+	$ndims = $v[3];
+	@dims = unpack "N"x$v[6], &$rd(4*$v[6]);
+      }
+      $d->{dims} = [ @dims[0..$ndims-1] ];
+      $d->{nelem} = $nelem;
+    }
+    my $seven = &$long;
+    print STDERR "$us: expected data-start key (7) but got $seven\n" if($seven != 7);
+    $d->{offset} = sysseek(IDX,0,1);
+    return $d;
+  };
+
+  my $pos = 4;
+  my %seen;
+  for(;;) {
+    sysseek(IDX,$pos,0);
+    my $type = &$long;
+    my $next = rec_next(&$rd(rec_hdr_len()));
+
+    if($type == 2) {                          # VARIABLE
+      my $vname = &$str;
+      $idx->{vars}->{$vname} = &$desc;
+      $idx->{vars}->{$vname}->{record} = $pos;
+      push(@{$idx->{order}}, $vname);
+    } elsif($type == 16) {                    # HEAP_DATA
+      my $hnum = &$long;
+      &$rd(4);
+      $idx->{heap}->{$hnum} = &$desc;
+      $idx->{heap}->{$hnum}->{record} = $pos;
+    } elsif($type == 10) {                    # TIMESTAMP
+      &$rd(1024);
+      $idx->{"+meta"}->{t_date} = &$str;
+      $idx->{"+meta"}->{t_user} = &$str;
+      $idx->{"+meta"}->{t_host} = &$str;
+    } elsif($type == 14) {                    # VERSION
+      $idx->{"+meta"}->{v_fmt} = &$long;
+      $idx->{"+meta"}->{v_arch} = &$str;
+      $idx->{"+meta"}->{v_os} = &$str;
+      $idx->{"+meta"}->{v_release} = &$str;
+    } elsif($type == 6) {                     # END_MARKER
+      last;
+    }
+
+    barf("$us: record chain loops back on itself in $name\n") if($seen{$next}++);
+    last if($next <= $pos or $next >= $size);
+    $pos = $next;
+  }
+  close(IDX);
+
+  return $idx;
+}
+
+=head2 ridl_var
+
+=for usage
+
+$pdl = ridl_var($idx, "IMAGE");
+$pdl = ridl_var($idx, "CUBE", {rows=>[100,199]});
+
+=for ref
+
+Decode one variable from an indexed IDL save file.
+
+C<$idx> comes from L<ridl_index|ridl_index>.  Numeric scalars and
+arrays come back as PDLs (complex values get an extra leading
+dimension of size 2), strings as perl strings.  Structures are not
+decoded; use L<ridl|ridl> for those.
+
+The "rows" option takes [first, last] along the last (slowest-varying)
+dimension of an array, and reads only that slab.
+
+=cut
+
+sub ridl_var {
+  my ($idx, $name, $opt) = @_;
+  my $d = $idx->{vars}->{uc $name} // $idx->{vars}->{$name};
+  barf("ridl_var: no variable $name in $idx->{file}\n") unless defined($d);
+  return ridl_decode($idx, $d, $opt // {}, "variable $name");
+}
+
+=head2 ridl_heap
+
+=for usage
+
+$val = ridl_heap($idx, $n);
+
+=for ref
+
+Decode heap value number C<$n> from an indexed IDL save file, as for
+L<ridl_var|ridl_var>.
+
+=cut
+
+sub ridl_heap {
+  my ($idx, $n, $opt) = @_;
+  my $d = $idx->{heap}->{$n};
+  barf("ridl_heap: no heap value $n in $idx->{file}\n") unless defined($d);
+  return ridl_decode($idx, $d, $opt // {}, "heap value $n");
+}
+
+sub ridl_decode {
+  my ($idx, $d, $opt, $what) = @_;
+
+  if($d->{struct}) {
+    print STDERR "ridl: $what is a structure; not decoded by the indexed reader\n";
+    return undef;
+  }
+
+  if($d->{type} == 7) {
+    barf("ridl: $what is a string array; not decoded by the indexed reader\n")
+      if($d->{dims});
+    local *IDX;
+    open(IDX,"<$idx->{file}") || barf("ridl: Can't open `$idx->{file}' for reading\n");
+    sysseek(IDX,$d->{offset},0);
+    # Length, then (if nonzero) the length again and the characters.
+    my $buf;
+    sysread(IDX,$buf,4);
+    my ($len) = unpack "N", $buf;
+    if($len) {
+      sysread(IDX,$buf,4);
+      sysread(IDX,$buf,$len);
+    }
+    close(IDX);
+    return $len ? unpack("A$len",$buf) : "";
+  }
+
+  my $t = $idx_types->{$d->{type}};
+  barf("ridl: $what has unsupported type $d->{type}\n") unless defined($t);
+  my ($ptype, $stride, $skip, $lead) = @$t;
+  my $cplx = ($d->{type} == 6 || $d->{type} == 9);
+
+  my @dims = $d->{dims} ? @{$d->{dims}} : ();
+  my $offset = $d->{offset};
+  # Scalar bytes carry a length word too (always 1).
+  $offset += $lead if($lead);
+
+  if(@dims and $opt->{rows}) {
+    my ($r0,$r1) = @{$opt->{rows}};
+    barf("ridl: rows [$r0,$r1] out of range for $what\n")
+      if($r0 < 0 or $r1 < $r0 or $r1 >= $dims[-1]);
+    my $per = 1;
+    $per *= $_ for @dims[0..$#dims-1];
+    $offset += $r0 * $per * $stride * ($cplx ? 2 : 1);
+    $dims[-1] = $r1 - $r0 + 1;
+  }
+
+  my $n = 1;
+  $n *= $_ for @dims;
+  $n *= 2 if($cplx);
+
+  my $out = PDL->new_from_specification($ptype, $n);
+  PDL::idlsav_read_helper($out, $idx->{file}, $offset, $stride, $skip);
+  return $out->sclr unless(@dims or $cplx);
+  return $out->reshape($cplx ? (2,@dims) : @dims);
+}
+
+=head2 ridl_check
+
+=for usage
+
+$nbad = PDL::IO::IDLSav::ridl_check( [$file] );
+
+=for ref
+
+Check that L<ridl|ridl> and L<ridl_var|ridl_var> agree.
+
+If C<$file> names an existing save file (use one written by IDL itself),
+every variable in it that ridl_var can read is read both ways and
+compared.  Otherwise a small save file is written (to C<$file>, or a
+scratch file in /tmp that is removed afterward) holding a PROMOTE64
+record followed by a long and a double array, and those are read back
+both ways and checked against the values written.  Returns the number
+of variables on which the readers differed.
+
+=cut
+
+sub ridl_check {
+  my $file = shift;
+  my %vals;
+
+  unless(defined($file) && -e $file) {
+    %vals = ( LVAR => sequence(long,5,3) * 7 - 20,
+	      DVAR => sequence(double,4,2) / 3 - 1 );
+    ridl_check_write($file // "/tmp/ridl_check_$$.sav", \%vals);
+  }
+  my $f = $file // "/tmp/ridl_check_$$.sav";
+
+  my $all = ridl($f);
+  my $idx = ridl_index($f);
+  my @names = %vals ? sort keys %vals : @{$idx->{order}};
+  my $nbad = 0;
+  for my $name(@names) {
+    my $vb = eval { ridl_var($idx, $name) };
+    if(!defined($vb) && !%vals) {
+      printf("ridl_check: %s: skipped (ridl_var can't read it)\n", $name);
+      next;
+    }
+    my $va = $all->{$name};
+    my $ok = (UNIVERSAL::isa($va,'PDL') && UNIVERSAL::isa($vb,'PDL') &&
+	      join(",",$va->dims) eq join(",",$vb->dims) &&
+	      all($va == $vb) && (!%vals || all($vb == $vals{$name})));
+    printf("ridl_check: %s: %s\n", $name, $ok ? "ok" : "readers disagree");
+    $nbad++ unless($ok);
+  }
+  unlink($f) unless(defined $file);
+  return $nbad;
+}
+
+# Write the synthetic file for ridl_check.  Record headers are laid out
+# as in rec_next: type, NEXTREC low and high words, and a spare long.
+sub ridl_check_write {
+  my ($file, $vals) = @_;
+  my %codes = ( LVAR => [3, "l>*", 4], DVAR => [5, "d>*", 8] );
+
+  my $out = "SR\0\4";
+  my $rec = sub {
+    my ($type,$body) = @_;
+    my $next = length($out) + 4 + rec_hdr_len() + length($body);
+    $out .= pack("NNNN", $type, $next % 2**32, int($next / 2**32), 0) . $body;
+  };
+
+  &$rec(17, "");
+  for my $name(sort keys %$vals) {
+    my ($code,$fmt,$size) = @{$codes{$name}};
+    my $v = $vals->{$name};
+    my $n = $v->nelem;
+    my @dims = ($v->dims, (1) x (8 - $v->ndims));
+    my $plen = length($name) - (length($name) % -4);
+    &$rec(2, pack("N",length($name)) . pack("a$plen",$name)
+	     . pack("NN", $code, 4)
+	     . pack("N8", 8, 0, $n*$size, $n, $v->ndims, 0, 0, 8)
+	     . pack("N8", @dims)
+	     . pack("N", 7)
+	     . pack($fmt, $v->list));
+  }
+  &$rec(6, "");
+
+  open(my $fh, ">", $file) || barf("ridl_check: Can't open `$file' for writing\n");
+  binmode $fh;
+  print $fh $out;
+  close($fh);
+}
+
+##############################
+# Tied hash for ridl(..., {lazy=>1}): variables are decoded on first FETCH.
+package PDL::IO::IDLSav::Lazy;
+
+sub TIEHASH  { my ($c,$idx) = @_; bless { idx=>$idx, cache=>{ "+meta" => $idx->{"+meta"} } }, $c }
+sub FETCH    { my ($s,$k) = @_;
+	       return $s->{cache}->{$k} if(exists $s->{cache}->{$k});
+	       return undef unless(exists $s->{idx}->{vars}->{$k});
+	       $s->{cache}->{$k} = PDL::IO::IDLSav::ridl_var($s->{idx},$k); }
+sub EXISTS   { my ($s,$k) = @_; exists($s->{idx}->{vars}->{$k}) || exists($s->{cache}->{$k}) }
+sub FIRSTKEY { my $s = shift; $s->{keys} = [ "+meta", @{$s->{idx}->{order}} ]; shift @{$s->{keys}} }
+sub NEXTKEY  { my $s = shift; shift @{$s->{keys}} }
+sub STORE    { my ($s,$k,$v) = @_; $s->{cache}->{$k} = $v }
+sub DELETE   { my ($s,$k) = @_; delete $s->{cache}->{$k} }
+
+package PDL::IO::IDLSav;
+
+use Inline Pdlpp => <<'EOF';
+pp_addhdr('
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+');
+
+pp_def('idlsav_read_helper',
+    Pars => '[o]out(n)',
+    OtherPars => 'char *file; long offset; int stride; int skip',
+    Code => <<'EOC',
+    int fd;
+    struct stat st;
+    unsigned char *map, *src, *dst;
+    int size = sizeof($GENERIC());
+    int little = 1;
+    PDL_Indx i;
+    int k;
+    little = *(unsigned char *)&little;
+
+    fd = open($COMP(file), O_RDONLY);
+    if(fd < 0)
+      barf("idlsav_read_helper: couldn't open %s", $COMP(file));
+    if(fstat(fd, &st)) {
+      close(fd);
+      barf("idlsav_read_helper: couldn't stat %s", $COMP(file));
+    }
+    if( $COMP(offset) + $SIZE(n) * $COMP(stride) > st.st_size ) {
+      close(fd);
+      barf("idlsav_read_helper: %s is truncated", $COMP(file));
+    }
+    /* Map the whole file -- only the pages we actually touch get read. */
+    map = (unsigned char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+      barf("idlsav_read_helper: couldn't mmap %s", $COMP(file));
+    madvise(map + ($COMP(offset) & ~(off_t)(getpagesize()-1)),
+            $SIZE(n) * $COMP(stride), MADV_SEQUENTIAL);
+
+    /* Save files are big-endian (XDR); swap on the way out if we aren't. */
+    src = map + $COMP(offset) + $COMP(skip);
+    for(i=0; i<$SIZE(n); i++, src += $COMP(stride)) {
+      dst = (unsigned char *)&($out(n=>i));
+      if(little)
+        for(k=0; k<size; k++)
+          dst[k] = src[size-1-k];
+      else
+        memcpy(dst, src, size);
+    }
+    munmap(map, st.st_size);
+EOC
+);
+EOF
+
+
 =head1 AUTHOR, LICENSE, NO WARRANTY
 
 Copyright (c) 2003 Craig DeForest.  THIS CODE IS PROVIDED WITH NO
@@ -466,6 +466,13 @@ sub evolve {
   print "updating...\n" if($PDL::verbose);
   update($me);
 
+  ##########
+  # Add in the spectral component, if there is one
+  if(defined $me->{s_amp}) {
+    print "adding spectral turbulence...\n" if($PDL::verbose);
+    $me->{vel} += $me->spectral_evolve($t)->mv(0,2);
+  }
+
   print "\n\n" if($PDL::verbose);
 }
   
@@ -531,3 +538,140 @@ sub write_image {
 
   wpic($out,$fname);
 }
+
+
+=head2 spectral_init
+
+=for usage
+
+  $turb->spectral_init(\%opt);
+
+=for ref
+
+Sets up a spectral turbulence generator alongside the cells.  The flow
+is a sum of Fourier modes (half potential, half stream function by
+default) with a power-law energy spectrum between two wavelengths.
+Each mode keeps its amplitude and just rotates its phase at a rate set
+by the eddy turnover time at its scale, so the field evolves smoothly
+and no new field has to be generated every step.  Synthesis is by one
+inverse real FFT per velocity component into a preallocated 2 x w x h
+buffer (the same layout as a corks FIELD, so it can be handed to
+Corks::add_flow).  After spectral_init, evolve adds the spectral flow
+into the cell velocity field.
+
+The synthesis is compiled (see Solar::Photosphere::Turbulence::Spectral)
+and needs FFTW and a C compiler; it's only loaded the first time
+spectral_init is called.
+
+Options:
+
+=over 3
+
+=item lmin, lmax (Mm; default 4 pixels and 4 cell radii)
+
+Shortest and longest wavelengths in the spectrum.
+
+=item slope (default -5/3)
+
+Power-law index of the energy spectrum E(k).
+
+=item vrms (default size/life)
+
+RMS speed of the field, in the same units as the cell flows.
+
+=item div (default 0.5)
+
+Fraction of the energy in the potential (diverging) part of the flow;
+the rest is in the stream function (vortical) part.
+
+=item life (default the cell life)
+
+Turnover time for eddies of the cell size; other scales go as k^(-2/3).
+
+=item threads (default 2)
+
+Worker threads for the synthesis (one per velocity component).
+
+=back
+
+=cut
+
+sub spectral_init {
+  my($me, $opt) = @_;
+  $opt = {} unless defined($opt);
+
+  # The synthesis is compiled against FFTW; only load it if it's wanted.
+  require Solar::Photosphere::Turbulence::Spectral;
+
+  my($w, $h, $dx) = ($me->{w}, $me->{h}, $me->{dx});
+  my $lmin  = $opt->{lmin}  || 4 * $dx;
+  my $lmax  = $opt->{lmax}  || 4 * $me->{size};
+  my $slope = defined($opt->{slope}) ? $opt->{slope} : -5/3;
+  my $vrms  = $opt->{vrms}  || $me->{size} / $me->{life};
+  my $div   = defined($opt->{div})   ? $opt->{div}   : 0.5;
+  my $life  = $opt->{life}  || $me->{life};
+
+  # Wavenumbers (cycles/Mm) of the half-plane spectrum of a real field
+  my $nu = int($w/2) + 1;
+  my $kx = xvals($nu, $h) / ($w * $dx);
+  my $ky = yvals($nu, $h);
+  $ky -= $h * ($ky > $h/2);
+  $ky /= $h * $dx;
+  my $k = sqrt($kx*$kx + $ky*$ky);
+  my $band = ($k >= 1/$lmax) & ($k <= 1/$lmin) & ($k > 0);
+  my $kk = $k + !$band;    # keep the powers finite outside the band
+
+  # Per-mode amplitude goes as sqrt(E(k)/k) in 2-D
+  my $a = $band * $kk ** (($slope - 1)/2);
+  my $amp = cat($a * sqrt($div), $a * sqrt(1 - $div))->mv(2,0)->copy;
+
+  # Eddy turnover time, Kolmogorov scaling from the cell size; the
+  # rate and sense of rotation are randomized per mode so the pattern
+  # decorrelates instead of drifting.
+  my $tau = $life * ($kk * 2 * $me->{size}) ** (-2/3);
+  my $omega = (2 * 3.14159 / $tau)->dummy(0,2) * 
+    (0.5 + random(2, $nu, $h)) * (2 * (random(2, $nu, $h) > 0.5) - 1);
+
+  $me->{s_amp}     = $amp;
+  $me->{s_omega}   = $omega;
+  $me->{s_phase}   = random(2, $nu, $h) * 2 * 3.14159;
+  $me->{s_threads} = $opt->{threads} || 2;
+  $me->{s_t}       = $me->{t};
+  $me->{svel}      = zeroes(double, 2, $w, $h);
+
+  # Normalize to the requested rms speed
+  PDL::turb_spectral_step($me->{s_amp}, $me->{s_omega}, $me->{s_phase}, $me->{svel}, 0, $me->{s_threads});
+  my $rms = sqrt( ($me->{svel} * $me->{svel})->sumover->avg );
+  if($rms > 0) {
+    $me->{s_amp} *= $vrms / $rms;
+    $me->{svel}  *= $vrms / $rms;
+  }
+  return $me;
+}
+
+=head2 spectral_evolve
+
+=for usage
+
+  $vel = $turb->spectral_evolve($t);
+
+=for ref
+
+Advances the spectral turbulence (see L<spectral_init|/spectral_init>)
+to time $t and returns the 2 x w x h velocity buffer.  The buffer is
+reused from call to call, so copy it if you want to keep it.
+
+=cut
+
+sub spectral_evolve {
+  my($me, $t) = @_;
+  die "spectral_evolve: call spectral_init first\n" unless(defined $me->{s_amp});
+  $t = $me->{t} unless(defined $t);
+
+  PDL::turb_spectral_step($me->{s_amp}, $me->{s_omega}, $me->{s_phase}, $me->{svel},
+			  $t - $me->{s_t}, $me->{s_threads});
+  $me->{s_t} = $t;
+  return $me->{svel};
+}
+
+1;
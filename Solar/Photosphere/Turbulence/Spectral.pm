@@ -0,0 +1,204 @@
+=head1 Solar::Photosphere::Turbulence::Spectral -- compiled synthesis for spectral turbulence
+
+=head1 Synopsis
+
+  require Solar::Photosphere::Turbulence::Spectral;
+  PDL::turb_spectral_step($amp, $omega, $phase, $vel, $dt, $nthreads);
+
+=head1 Description
+
+The compiled half of L<Solar::Photosphere::Turbulence/spectral_init>.
+It needs FFTW (via Alien::FFTW3) and a C compiler, so
+Solar::Photosphere::Turbulence only requires it from spectral_init;
+turbulence made of cells alone loads without it.
+
+=cut
+
+package Solar::Photosphere::Turbulence::Spectral;
+use PDL;
+
+##############################
+# Compiled synthesis.  The phases advance by omega*dt, then each
+# velocity component is assembled from the potential and stream-function
+# modes,
+#
+#     vx(k) = i (kx/|k|) phi(k) - i (ky/|k|) psi(k)
+#     vy(k) = i (ky/|k|) phi(k) + i (kx/|k|) psi(k)
+#
+# and inverse transformed.  The c2r plan is cached across calls and
+# shared by the worker threads (new-array execute), each of which has
+# its own FFTW buffers.
+
+use Alien::FFTW3;
+use Inline "Pdlpp" => Config =>
+    INC=> Alien::FFTW3->cflags,
+    LIBS => Alien::FFTW3->libs . " -lpthread";
+
+use Inline "Pdlpp" => <<'EOF';
+pp_addhdr('
+#include <fftw3.h>
+#include <pthread.h>
+#include <math.h>
+#include <stdlib.h>
+
+typedef struct {
+  double *amp, *phase;
+  double *vel;
+  PDL_Indx vs[3];
+  PDL_Indx w, h, nu;
+  fftw_plan rev;
+} ts_job;
+
+typedef struct {
+  ts_job *job;
+  int c;
+  double *buf;
+  fftw_complex *spec;
+} ts_worker;
+
+static void ts_component(ts_job *j, ts_worker *wk) {
+  PDL_Indx u, v, x, y;
+  int c = wk->c;
+
+  for(v=0; v<j->h; v++) {
+    double ky = (v <= j->h/2) ? v : v - j->h;
+    ky /= j->h;
+    for(u=0; u<j->nu; u++) {
+      PDL_Indx i = u + v*j->nu;
+      double kx = (double)u / j->w;
+      double k = sqrt(kx*kx + ky*ky);
+      double *a = j->amp + 2*i, *p = j->phase + 2*i;
+      double fr, fi, sr, si, cp, cs;
+
+      if(k == 0 || (a[0] == 0 && a[1] == 0)) {
+        wk->spec[i][0] = wk->spec[i][1] = 0;
+        continue;
+      }
+      fr = a[0] * cos(p[0]);  fi = a[0] * sin(p[0]);
+      sr = a[1] * cos(p[1]);  si = a[1] * sin(p[1]);
+      cp = (c ? ky : kx) / k;
+      cs = (c ? kx : -ky) / k;
+      /* i * (cp*phi + cs*psi) */
+      wk->spec[i][0] = -(cp*fi + cs*si);
+      wk->spec[i][1] =   cp*fr + cs*sr;
+    }
+  }
+
+  fftw_execute_dft_c2r(j->rev, wk->spec, wk->buf);
+
+  for(y=0; y<j->h; y++)
+    for(x=0; x<j->w; x++)
+      j->vel[c*j->vs[0] + x*j->vs[1] + y*j->vs[2]] = wk->buf[x + y*j->w];
+}
+
+static void *ts_worker_run(void *arg) {
+  ts_worker *wk = (ts_worker *)arg;
+  ts_component(wk->job, wk);
+  return NULL;
+}
+
+/* Free the work space and whatever scratch space got allocated */
+static void ts_free(ts_job *j, ts_worker *wk) {
+  int c;
+  for(c=0; c<2; c++) {
+    if(wk[c].buf)  fftw_free(wk[c].buf);
+    if(wk[c].spec) fftw_free(wk[c].spec);
+  }
+  free(j->amp);
+}
+');
+
+pp_def('turb_spectral_step',
+    Pars => 'amp(m=2,u,v); omega(m=2,u,v); [io]phase(m=2,u,v); [o]vel(c=2,x,y)',
+    OtherPars => 'double dt; int nthreads',
+    GenericTypes => [D],
+    HandleBad => 0,
+    Code => <<'EOC',
+    static fftw_plan plan_rev = 0;
+    static int plan_dims[2] = {0,0};
+    ts_job job;
+    ts_worker wk[2];
+    pthread_t tid;
+    PDL_Indx w = $SIZE(x), h = $SIZE(y), nu = $SIZE(u);
+    PDL_Indx i, u, v;
+    int c;
+
+    if(nu != w/2 + 1 || $SIZE(v) != h)
+      barf("turb_spectral_step: spectrum is %dx%d, expected %dx%d", (int)nu, (int)$SIZE(v), (int)(w/2+1), (int)h);
+
+    /* Advance the phases (kept in [0, 2pi) so they don't lose precision) */
+    for(v=0; v<h; v++)
+      for(u=0; u<nu; u++)
+        for(c=0; c<2; c++) {
+          double p = $phase(m=>c, u=>u, v=>v) + $omega(m=>c, u=>u, v=>v) * $COMP(dt);
+          p = fmod(p, 2*M_PI);
+          if(p < 0) p += 2*M_PI;
+          $phase(m=>c, u=>u, v=>v) = p;
+        }
+
+    /* (Re)make the plan only if the grid has changed since last time. */
+    if( !plan_rev || plan_dims[0] != h || plan_dims[1] != w ) {
+      double *tbuf = (double *)fftw_malloc( w * h * sizeof(double) );
+      fftw_complex *tspec = (fftw_complex *)fftw_malloc( nu * h * sizeof(fftw_complex) );
+      if(!tbuf || !tspec) {
+        if(tbuf)  fftw_free(tbuf);
+        if(tspec) fftw_free(tspec);
+        barf("turb_spectral_step: couldn't allocate planning space");
+      }
+      if(plan_rev)
+        fftw_destroy_plan(plan_rev);
+      plan_dims[0] = h;
+      plan_dims[1] = w;
+      plan_rev = fftw_plan_dft_c2r( 2, plan_dims, tspec, tbuf, FFTW_MEASURE );
+      fftw_free(tbuf);
+      fftw_free(tspec);
+      if(!plan_rev)
+        barf("turb_spectral_step: couldn't make the FFTW plan");
+    }
+
+    /* The worker code wants contiguous amplitudes and phases */
+    job.amp   = (double *)malloc( 4 * nu * h * sizeof(double) );
+    job.phase = job.amp + 2 * nu * h;
+    if(!job.amp)
+      barf("turb_spectral_step: couldn't allocate work space");
+    i = 0;
+    for(v=0; v<h; v++)
+      for(u=0; u<nu; u++, i++)
+        for(c=0; c<2; c++) {
+          job.amp[2*i+c]   = $amp(m=>c, u=>u, v=>v);
+          job.phase[2*i+c] = $phase(m=>c, u=>u, v=>v);
+        }
+
+    job.vel = &($vel(c=>0,x=>0,y=>0));
+    job.vs[0] = &($vel(c=>1,x=>0,y=>0)) - job.vel;
+    job.vs[1] = (w > 1) ? &($vel(c=>0,x=>1,y=>0)) - job.vel : 0;
+    job.vs[2] = (h > 1) ? &($vel(c=>0,x=>0,y=>1)) - job.vel : 0;
+    job.w = w;  job.h = h;  job.nu = nu;
+    job.rev = plan_rev;
+
+    for(c=0; c<2; c++) {
+      wk[c].job  = &job;
+      wk[c].c    = c;
+      wk[c].buf  = (double *)fftw_malloc( w * h * sizeof(double) );
+      wk[c].spec = (fftw_complex *)fftw_malloc( nu * h * sizeof(fftw_complex) );
+    }
+    if(!wk[0].buf || !wk[0].spec || !wk[1].buf || !wk[1].spec) {
+      ts_free(&job, wk);
+      barf("turb_spectral_step: couldn't allocate scratch space");
+    }
+
+    /* If the second thread won't start, do both components here */
+    if($COMP(nthreads) > 1 && !pthread_create( &tid, NULL, ts_worker_run, &wk[1] )) {
+      ts_component(&job, &wk[0]);
+      pthread_join( tid, NULL );
+    } else {
+      ts_component(&job, &wk[0]);
+      ts_component(&job, &wk[1]);
+    }
+
+    ts_free(&job, wk);
+EOC
+);
+EOF
+
+1;
@@ -14,10 +14,53 @@ BEGIN {
 		    sg_ids
 		    g_ids
 		    update_sim
+		    decompose_sim
+		    undecompose_sim
+		    defer_shrinkers
+		    open_events
+		    close_events
+		    read_events
+		    add_flow
                  
 		 /);
     bootstrap Corks;
 }
 
+##############################
+# add_flow - add an extra 2 x w x h flow (e.g. from 
+# Solar::Photosphere::Turbulence::spectral_evolve) into the total flow 
+# that the magnetic corks ride on.  It's copied in and stays until the
+# next call; add_flow($sim, undef) drops it.
+sub add_flow {
+    my($sim, $v) = @_;
+    _set_extra_flow($sim, defined($v) ? double($v)->make_physical : undef);
+}
+
+##############################
+# read_events - read an event log written after open_events($sim, $file).
+# Returns a hash of PDLs (t, x, y, id, parent, type), one element per event.
+# Types: 1-3 born (supergranule, granule, magnetic cork), 4 bipole 
+# emergence, 5-7 died, 8-10 advected out of the domain.
+sub read_events {
+    my $file = shift;
+    local $/;
+    open my $fh, "<", $file or die "read_events: couldn't open $file: $!\n";
+    binmode $fh;
+    my $s = <$fh>;
+    close $fh;
+    die "read_events: $file isn't a corks event log\n" 
+	unless(substr($s,0,8) eq "CORKSEV1");
+
+    my @v = unpack("(d f f q q l x4)*", substr($s,8));
+    my $ev = pdl(double, \@v)->reshape(6, @v/6);
+    return { t      => $ev->slice("(0)")->sever,
+	     x      => $ev->slice("(1)")->sever,
+	     y      => $ev->slice("(2)")->sever,
+	     id     => longlong($ev->slice("(3)")),
+	     parent => longlong($ev->slice("(4)")),
+	     type   => long($ev->slice("(5)"))
+    };
+}
+
 
 1;
@@ -133,6 +133,9 @@ CODE:
  if( (svp = hv_fetch(phv, "cork_B", 6, 0)) && *svp != &PL_sv_undef )
    w->p->cork_B == SvNV(*svp);
 
+ if( (svp = hv_fetch(phv, "seed", 4, 0)) && *svp != &PL_sv_undef )
+   srandom(SvIV(*svp));
+
  update_params(w); 
 
  RETVAL = (IV)w;
@@ -276,6 +279,63 @@ update_sim(wi,n=1)
 CODE:
  update_sim((WORLD *)wi, n);
 
+IV
+decompose_sim(wi,nproc)
+ IV wi
+ IV nproc
+CODE:
+ RETVAL = !decompose_world((WORLD *)wi, nproc);
+OUTPUT:
+ RETVAL
+
+void
+undecompose_sim(wi)
+ IV wi
+CODE:
+ undecompose_world((WORLD *)wi);
+
+void
+defer_shrinkers(wi,on=1)
+ IV wi
+ IV on
+CODE:
+ ((WORLD *)wi)->defer_shrinkers = (on != 0);
+
+void
+_set_extra_flow(wi,sv)
+ IV wi
+ SV *sv
+PREINIT:
+ WORLD *w;
+ pdl *p;
+CODE:
+ w = (WORLD *)wi;
+ if(!SvOK(sv)) {
+   set_extra_flow(w, 0);
+ } else {
+   p = PDL->SvPDLV(sv);
+   PDL->make_physical(p);
+   if(p->datatype != PDL_D || p->ndims != 3 || 
+      p->dims[0] != 2 || p->dims[1] != w->p->w || p->dims[2] != w->p->h)
+     croak("add_flow: need a 2 x %d x %d double PDL", w->p->w, w->p->h);
+   set_extra_flow(w, (double *)(p->data));
+ }
+
+IV
+open_events(wi,fname)
+ IV wi
+ char *fname
+CODE:
+ RETVAL = !open_event_log((WORLD *)wi, fname);
+OUTPUT:
+ RETVAL
+
+void
+close_events(wi)
+ IV wi
+CODE:
+ close_event_log((WORLD *)wi);
+
 BOOT:
 /**********************************************************************
  **** bootstrap code -- load-time dynamic linking to pre-loaded PDL
@@ -1,6 +1,19 @@
 #include "corkslib.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
 #define CORKS_DEBUG 0
 
@@ -104,6 +117,7 @@ CORKS *new_corks(long size) {
   cs->unused = 0;
   cs->array = 0;
   corks_grow(cs, size);
+  return cs;
 }
 
 
@@ -236,6 +250,10 @@ WORLD *new_world(long w, long h) {
   wld->mc = new_corks(10000);
   wld->next_label = 1;
   wld->next_clabel = 1;
+  wld->dc = 0;
+  wld->ev = 0;
+  wld->extra = 0;
+  wld->defer_shrinkers = 0;
   wld->p = new_params();
   wld->p->w = w;
   wld->p->h = h;
@@ -247,6 +265,12 @@ WORLD *new_world(long w, long h) {
 }
 
 void free_world(WORLD *w) {
+  if(w->dc)
+    undecompose_world(w);
+  if(w->ev)
+    close_event_log(w);
+  if(w->extra)
+    free_field(w->extra);
   free_params(w->p);
   free_corks(w->mc);
   free_corks(w->gc);  
@@ -306,6 +330,109 @@ void update_params(WORLD *wld) {
 
 }
 
+/**********************************************************************
+ * Event log.  Events are only ever raised by the main process (the 
+ * decomposed workers just compute), so one append buffer per WORLD is
+ * enough; it goes out to the file when it fills and at the end of each
+ * update_sim call.
+ */
+int open_event_log(WORLD *w, char *fname) {
+  EVLOG *ev;
+  FILE *fp;
+
+  if(w->ev)
+    close_event_log(w);
+
+  fp = fopen(fname, "wb");
+  if(!fp)
+    return 1;
+  fwrite("CORKSEV1", 1, 8, fp);
+
+  ev = (EVLOG *)malloc(sizeof(EVLOG));
+  ev->fp = fp;
+  ev->size = 65536;
+  ev->n = 0;
+  ev->buf = (CORKS_EVENT *)malloc(sizeof(CORKS_EVENT) * ev->size);
+  w->ev = ev;
+  return 0;
+}
+
+void flush_event_log(WORLD *w) {
+  EVLOG *ev = w->ev;
+  if(!ev)
+    return;
+  if(ev->n) {
+    if(fwrite(ev->buf, sizeof(CORKS_EVENT), ev->n, ev->fp) != (size_t)ev->n)
+      fprintf(stderr,"flush_event_log: short write - event log is incomplete\n");
+    ev->n = 0;
+  }
+  fflush(ev->fp);
+}
+
+void close_event_log(WORLD *w) {
+  if(!w->ev)
+    return;
+  flush_event_log(w);
+  fclose(w->ev->fp);
+  free(w->ev->buf);
+  free(w->ev);
+  w->ev = 0;
+}
+
+void corks_event(WORLD *w, int type, long id, double x, double y, long parent) {
+  EVLOG *ev = w->ev;
+  CORKS_EVENT *e;
+
+  if(!ev)
+    return;
+  if(ev->n >= ev->size)
+    flush_event_log(w);
+
+  e = ev->buf + (ev->n++);
+  e->t = w->t;
+  e->x = x;
+  e->y = y;
+  e->id = id;
+  e->parent = parent;
+  e->type = type;
+  e->pad = 0;
+}
+
+/* ID of the cell covering a location in a field (clipped to the field), or 0 */
+long field_id_at(FIELD *f, double x, double y) {
+  long ix = x + 0.5;
+  long iy = y + 0.5;
+  if(!f)
+    return 0;
+  if(ix < 0)
+    ix = 0;
+  if(ix >= f->w)
+    ix = f->w - 1;
+  if(iy < 0)
+    iy = 0;
+  if(iy >= f->h)
+    iy = f->h - 1;
+  return f->id[ ix + iy * f->w ];
+}
+
+/* Which population a CORKS list is (CORKS_POP_*) */
+int corks_pop(WORLD *w, CORKS *corks) {
+  if(corks == w->sgc) return CORKS_POP_SG;
+  if(corks == w->gc)  return CORKS_POP_G;
+  return CORKS_POP_MC;
+}
+
+/* Log the death (or exit) of a cork, with the cell of the next scale up */
+static void cork_died(WORLD *w, CORKS *corks, CORK *c, int type) {
+  int pop;
+  FIELD *up;
+  if(!w->ev)
+    return;
+  pop = corks_pop(w, corks);
+  up = (pop == CORKS_POP_G) ? w->sg : (pop == CORKS_POP_MC) ? w->g : 0;
+  corks_event(w, type + pop, c->id, c->x, c->y, field_id_at(up, c->x, c->y));
+}
+
 /**********************************************************************
  **********************************************************************
  ****
@@ -351,7 +478,7 @@ void new_mag_bipole(WORLD *w, double x, double y, double deltat) {
     return;
 
   // Find offset into field array
-  of = (long)(xof + 0.5) + (long)(yof + 0.5) * (w->p->w);
+  of = (long)(x + 0.5) + (long)(y + 0.5) * (w->p->w);
 
   id = w->g->id[of];
   if(id) {
@@ -373,6 +500,13 @@ void new_mag_bipole(WORLD *w, double x, double y, double deltat) {
   
   new_mag_cork(w, x+xof, y+yof,  1);
   new_mag_cork(w, x-xof, y-yof, -1);
+
+  if(w->ev) {
+    long cid = w->next_clabel - 2;
+    corks_event(w, CORKS_EV_BIPOLE, cid, x, y, id);
+    corks_event(w, CORKS_EV_BORN + CORKS_POP_MC, cid,       x+xof, y+yof, id);
+    corks_event(w, CORKS_EV_BORN + CORKS_POP_MC, -(cid+1),  x-xof, y-yof, id);
+  }
 }
   
   
@@ -409,6 +543,7 @@ void new_granule(WORLD *w, double x, double y, double deltat) {
   g.rmax_pix = 0;
 
   corks_add_cork(w->gc, &g);
+  corks_event(w, CORKS_EV_BORN + CORKS_POP_G, id, x, y, field_id_at(w->sg, x, y));
 }
 
 void remove_granule(WORLD *w, long pos) {
@@ -468,6 +603,7 @@ void remove_granule(WORLD *w, long pos) {
   printf("%d pixels\n",total_pixels);
 
   // Now delete the record of the granule from the list.
+  cork_died(w, w->gc, gc, CORKS_EV_DIED);
   corks_delete_cork( w->gc, pos);
 }
 
@@ -503,6 +639,7 @@ void new_supergranule(WORLD *w, double x, double y, double deltat) {
   sg.rmax_pix = 0;
 
   corks_add_cork(w->sgc, &sg);
+  corks_event(w, CORKS_EV_BORN + CORKS_POP_SG, id, x, y, 0);
 }
 
 void remove_supergranule(WORLD *w, long pos) {
@@ -556,6 +693,7 @@ void remove_supergranule(WORLD *w, long pos) {
   } while(hits);
 
   // Now delete the record of the granule from the list.
+  cork_died(w, w->sgc, sgc, CORKS_EV_DIED);
   corks_delete_cork( w->sgc, pos);
 }
 
@@ -712,6 +850,56 @@ double div_flow( double flow_out[2], double div, double x_of, double y_of ) {
   return magnitude;
 }
 
+/**********************************************************************
+ * cork_footprint
+ * Work out a field cork's current divergence and relative age, and the 
+ * block of pixels (xmin, xmax, ymin, ymax) its flow can reach this step.
+ */
+void cork_footprint(WORLD *wld, CORKS *corks, CORK *c, double *div_out, double *relage_out, long box[4]) {
+  double age, relage, rl, div;
+  long rmax_pix;
+  long xmin,xmax,ymin,ymax;
+
+  age = (wld->t - c->t_born);
+  relage = age / corks->life;         // relative age
+  rl = (relage >0) ? ( (relage < 1) ? relage : 1) : 0; // clipped age
+  
+  div = corks->div * (1 + 2 * sin( pi2 * rl )) / 2;    // calculated divergence
+
+  if(c->rmax_pix<=5)
+    c->rmax_pix=5;
+ 
+  rmax_pix = (  c->rmax_pix +                                                   // old rmax_pix
+		div * wld->p->dt / wld->p->dx / wld->p->dx / c->rmax_pix        // divergence expansion
+		+1
+		) * 1.5;
+
+  //  if(c->id % 500 == 0)
+  //    printf("id %d: c->t_born=%g; t=%g; relage=%g; rl=%g; div=%g; c->rmax_pix=%d; rmax_pix = %d\n",c->id,c->t_born,wld->t,relage,rl,div,c->rmax_pix, rmax_pix );
+  
+  // Now find the bounds of a small array that's rmax*2+1 x rmax*2+1 centered on the 
+  // granule location...
+  
+  xmin = c->x - rmax_pix;
+  if(xmin<0) xmin=0; if(xmin >= wld->p->w) xmin=wld->p->w-1;
+  
+  xmax = c->x + rmax_pix;
+  if(xmax<0) xmax=0; if(xmax >= wld->p->w) xmax=wld->p->w-1;
+  
+  ymin = c->y - rmax_pix;
+  if(ymin<0) ymin=0; if(ymin >= wld->p->h) ymax=wld->p->h-1;
+  
+  ymax = c->y + rmax_pix;
+  if(ymax<0) ymax=0; if(ymax >= wld->p->h) ymax=wld->p->h-1;
+
+  *div_out = div;
+  *relage_out = relage;
+  box[0] = xmin;
+  box[1] = xmax;
+  box[2] = ymin;
+  box[3] = ymax;
+}
+
 /**********************************************************************
  **********************************************************************
  *** granule/supergranule/cork updator/advector
@@ -723,13 +911,43 @@ double div_flow( double flow_out[2], double div, double x_of, double y_of ) {
  ***   or 0 (should be 0 if f or fpre are 0).
  ***
  *** if the redux_flag is set then shrinkers are not deleted.
+ ***
+ *** Shrinkers are normally deleted as they're found, in the middle of
+ *** the pass, so later corks in the same pass can take their pixels.
+ *** If wld->defer_shrinkers is set they're removed at the end of the
+ *** pass instead, after every cork has been painted, and their pixels
+ *** are only up for grabs in the second pass.  That's the variant the
+ *** multi-process engine computes (decompose_world turns the flag on),
+ *** so a single-process run with the flag set matches a decomposed one.
  */
 
+/* Zero out and delete the shrinkers found in a pass.  sh holds, for
+ * each one, its index in the corks list and its footprint box.  */
+static void remove_shrinkers(WORLD *wld, CORKS *corks, FIELD *f, long *sh, long n) {
+  long s, x, y;
+  for(s=0; s<n; s++) {
+    long *b = sh + s*5;
+    CORK *c = corks->array + b[0];
+    for(y=b[3]; y<=b[4]; y++) {
+      for(x=b[1]; x<=b[2]; x++) {
+	long of = y * f->w + x;
+	if(f->id[of] == c->id) {
+	  f->id[of] = 0;
+	  f->V[of*2] = f->V[of*2+1] = 0;
+	}
+      }
+    }
+    cork_died(wld, corks, c, CORKS_EV_DIED);
+    corks_delete_cork(corks, b[0]);
+  }
+}
+
 void update_field(WORLD *wld, CORKS *corks, FIELD *f, FIELD *fpre, FIELD *ftot, char *name) {
   double dt = wld->p->dt;
   double t  = wld->t;
   long i, passno;
   long shrinkers;
+  long *sh = 0;
 
   printf("Processing %ss...\n",name);
   printf("advecting %d %ss (maxn=%d)\n",corks->maxn - corks->unused, name, corks->maxn);
@@ -738,6 +956,7 @@ void update_field(WORLD *wld, CORKS *corks, FIELD *f, FIELD *fpre, FIELD *ftot,
     for(i=0;i<corks->maxn;i++) {
       if(corks->array[i].id) {
 	if(advect_cork(corks->array + i, fpre, dt, wld->p->dx)) {
+	  cork_died(wld, corks, corks->array + i, CORKS_EV_EXIT);
 	  corks->array[i].id = 0;
 	  corks->unused++;
 	}
@@ -747,56 +966,30 @@ void update_field(WORLD *wld, CORKS *corks, FIELD *f, FIELD *fpre, FIELD *ftot,
 
   // If a field exists, then calculate and update the relevant portion of it.
   if(f) {
+    if(wld->defer_shrinkers)
+      sh = (long *)malloc( (corks->maxn + 1) * 5 * sizeof(long) );
     passno = 0;
     do {
       shrinkers = 0;
 
       printf("updating %d %ss (maxn=%d); pass %d\n",corks->maxn - corks->unused, name, corks->maxn, passno);
-      
+
       for(i=0;i<corks->maxn;i++) {
 	if(corks->array[i].id) {
 	  CORK *c = corks->array + i;
 	  
-	  double age, relage, rl, div;
+	  double relage, div;
 	  long rmax_pix;
+	  long box[4];
 	  long xmin,xmax,ymin,ymax, x, y;	
 	  double V[2];
 	  long pix_count = 0; // number of field pixels affiliated with this cork
 	  
-	  age = (wld->t - c->t_born);
-	  relage = age / corks->life;         // relative age
-	  rl = (relage >0) ? ( (relage < 1) ? relage : 1) : 0; // clipped age
-	  
-	  
-	  div = corks->div * (1 + 2 * sin( pi2 * rl )) / 2;    // calculated divergence
-
-	  if(c->rmax_pix<=5)
-	    c->rmax_pix=5;
- 
-	  rmax_pix = (  c->rmax_pix +                                                   // old rmax_pix
-			div * wld->p->dt / wld->p->dx / wld->p->dx / c->rmax_pix        // divergence expansion
-			+1
-			) * 1.5;
-
-
-	  //	  if(c->id % 500 == 0)
-	  //	    printf("id %d: c->t_born=%g; t=%g; relage=%g; rl=%g; div=%g; c->rmax_pix=%d; rmax_pix = %d\n",c->id,c->t_born,wld->t,relage,rl,div,c->rmax_pix, rmax_pix );
-	  
-	  
-	  // Now find the bounds of a small array that's rmax*2+1 x rmax*2+1 centered on the 
-	  // granule location...
-	  
-	  xmin = c->x - rmax_pix;
-	  if(xmin<0) xmin=0; if(xmin >= wld->p->w) xmin=wld->p->w-1;
-	  
-	  xmax = c->x + rmax_pix;
-	  if(xmax<0) xmax=0; if(xmax >= wld->p->w) xmax=wld->p->w-1;
-	  
-	  ymin = c->y - rmax_pix;
-	  if(ymin<0) ymin=0; if(ymin >= wld->p->h) ymax=wld->p->h-1;
-	  
-	  ymax = c->y + rmax_pix;
-	  if(ymax<0) ymax=0; if(ymax >= wld->p->h) ymax=wld->p->h-1;
+	  cork_footprint(wld, corks, c, &div, &relage, box);
+	  xmin = box[0];
+	  xmax = box[1];
+	  ymin = box[2];
+	  ymax = box[3];
 	  
 	  // Iterate over the block...
 	  rmax_pix = 0;
@@ -840,32 +1033,560 @@ void update_field(WORLD *wld, CORKS *corks, FIELD *f, FIELD *fpre, FIELD *ftot,
 	  if(pix_count > c->max_pixels)
 	    c->max_pixels = pix_count;
 
-	  // If the cork shrank too much, zero it out and delete it.
+	  // If the cork shrank too much, zero it out and delete it (now,
+	  // or at the end of the pass if shrinkers are deferred).
 	  else if(pix_count < c->max_pixels / 4 || relage >= 1.5) {
 	    //  printf(" cork %d is a shrinker - deleting...\n");
+	    long now[5];
+	    long *b = sh ? sh + shrinkers*5 : now;
+	    b[0] = i;
+	    b[1] = xmin;
+	    b[2] = xmax;
+	    b[3] = ymin;
+	    b[4] = ymax;
 	    shrinkers++;
-	    for(y=ymin; y<=ymax; y++) {
-	      for(x=xmin; x<=xmax; x++) {
-		long of = y * f->w + x;
-		if(f->id[of] == c->id) {
-		  f->id[of] = 0;
-		  f->V[of*2] = f->V[of*2+1] = 0;
-		}
-	      }
-	    }
-	    //	    printf("  calling corks_delete_cork(%d) (id was %d;%d)\n",i,c->id,corks->array[i].id);
-	    corks_delete_cork(corks, i); 
+	    if(!sh)
+	      remove_shrinkers(wld, corks, f, b, 1);
 	  } // end of cork deletion
 	} // end of cork-OK check
       } // end of corks loop
+      if(sh)
+	remove_shrinkers(wld, corks, f, sh, shrinkers);
       if(shrinkers && (passno==0)) 
 	printf("   found %d shrinkers; repeating\n",shrinkers);
     } while(shrinkers && (passno++)==0);
+    free(sh);
   } // end of field check
 }
   
 
 
+/**********************************************************************
+ **********************************************************************
+ *** Domain decomposition
+ ***
+ *** decompose_world moves the three flow fields into one POSIX shared
+ *** memory segment and forks nproc-1 worker processes.  The calling
+ *** process is worker 0.  Each worker owns a strip of rows, 
+ *** [h*k/nproc, h*(k+1)/nproc), and is the only one to write those rows.
+ ***
+ *** Every worker sees the whole of every field, so the halo around a
+ *** strip is as wide as it needs to be: a cork near a strip boundary
+ *** (whatever its radius) is painted by each worker whose strip its
+ *** footprint reaches, each one writing only its own rows.  Corks stay
+ *** in the parent's CORKS lists and are copied into a shared scratch
+ *** table each step, so nothing has to migrate between workers.
+ ***
+ *** Each worker replays the corks in list order, so every pixel sees
+ *** the same sequence of updates it would see in a single loop; the
+ *** per-cork pixel counts and radii are summed and maxed over the
+ *** strips afterward.  The one difference from update_field's default
+ *** is that shrinkers can only be removed at the end of a pass, once
+ *** the counts are in, so decompose_world sets wld->defer_shrinkers
+ *** (and leaves it set after undecompose_world, so a run doesn't change
+ *** rules halfway).  A decomposed run with any number of workers gives
+ *** exactly the fields of a single-process run with deferred shrinkers
+ *** at the same random seed -- not those of a default single-process run.
+ ***
+ *** This spreads the painting over processes, not the memory: every
+ *** worker maps all three fields, so each one needs as much as a
+ *** single-process run does.
+ ***/
+
+#define DC_ADVECT 1
+#define DC_PAINT  2
+#define DC_EXIT   3
+
+typedef struct DC_CORK {
+  long id;
+  double x;
+  double y;
+  double div;
+  double relage;
+  long box[4];       /* xmin, xmax, ymin, ymax */
+  int out;           /* advect_cork went out of bounds */
+} DC_CORK;
+
+typedef struct DC_CTL {
+  pthread_barrier_t start;
+  pthread_barrier_t done;
+  int cmd;
+  int which[3];      /* f, fpre, ftot: 0=sg, 1=g, 2=tot, -1=none */
+  long n;            /* number of corks in the scratch table */
+  double dt;
+  double dx;
+} DC_CTL;
+
+typedef struct DECOMP {
+  int nproc;
+  pid_t *pids;
+  void *fmem;        /* shared segment holding the fields */
+  size_t fmem_len;
+  void *cmem;        /* shared segment holding ctl + cork scratch */
+  size_t cmem_len;
+  DC_CTL *ctl;
+  DC_CORK *ck;
+  long *pix;         /* per-cork, per-worker pixel counts */
+  long *r2;          /* per-cork, per-worker max squared radius */
+  long cap;          /* capacity of the scratch table */
+} DECOMP;
+
+/* Map a fresh POSIX shared memory segment, unlinked right away so it 
+ * goes away with the last process that has it mapped.  */
+static void *dc_shm(size_t len) {
+  static long serial = 0;
+  char name[64];
+  void *mem;
+  int fd;
+
+  sprintf(name,"/corks-%ld-%ld",(long)getpid(),serial++);
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if(fd < 0) 
+    return 0;
+  shm_unlink(name);
+  if(ftruncate(fd, len)) {
+    close(fd);
+    return 0;
+  }
+  mem = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return (mem == MAP_FAILED) ? 0 : mem;
+}
+
+static FIELD *dc_field(WORLD *wld, int which) {
+  switch(which) {
+  case 0: return wld->sg;
+  case 1: return wld->g;
+  case 2: return wld->tot;
+  }
+  return 0;
+}
+
+static int dc_which(WORLD *wld, FIELD *f) {
+  if(!f)            return -1;
+  if(f == wld->sg)  return 0;
+  if(f == wld->g)   return 1;
+  if(f == wld->tot) return 2;
+  fprintf(stderr,"dc_which: unknown field - this should never happen\n");
+  return -1;
+}
+
+/* One worker's share of the current command */
+static void dc_work(WORLD *wld, DECOMP *dc, int k) {
+  DC_CTL *ctl = dc->ctl;
+  FIELD *f    = dc_field(wld, ctl->which[0]);
+  FIELD *fpre = dc_field(wld, ctl->which[1]);
+  FIELD *ftot = dc_field(wld, ctl->which[2]);
+  long i;
+
+  if(ctl->cmd == DC_ADVECT) {
+    // Corks are independent here; deal them out round-robin.
+    for(i=k; i<ctl->n; i+=dc->nproc) {
+      DC_CORK *d = dc->ck + i;
+      CORK c;
+      if(!d->id)
+	continue;
+      c.id = d->id;
+      c.x = d->x;
+      c.y = d->y;
+      d->out = advect_cork(&c, fpre, ctl->dt, ctl->dx);
+      d->x = c.x;
+      d->y = c.y;
+    }
+  } 
+
+  else if(ctl->cmd == DC_PAINT) {
+    long y0 = f->h * k / dc->nproc;
+    long y1 = f->h * (k+1) / dc->nproc - 1;
+
+    for(i=0; i<ctl->n; i++) {
+      DC_CORK *d = dc->ck + i;
+      long pix_count = 0;
+      long rmax_pix = 0;
+      long ymin, ymax, x, y;
+      double V[2];
+
+      if(d->id) {
+	ymin = (d->box[2] > y0) ? d->box[2] : y0;
+	ymax = (d->box[3] < y1) ? d->box[3] : y1;
+	
+	for(y=ymin; y<=ymax; y++) {
+	  for(x=d->box[0]; x<=d->box[1]; x++) {
+	    double flow_mag;
+	    long of = y * f->w + x;
+	    long of2 = of*2;
+	    
+	    flow_mag = div_flow( V, d->div, (x - d->x) * ctl->dx, (y - d->y) * ctl->dx );
+	    
+	    // Same test as in update_field
+	    if( (f->id[of] == d->id) || 
+		( (f->V[of2]*f->V[of2] + f->V[of2+1]*f->V[of2+1]) < flow_mag*flow_mag ) ) {
+	      double r2_pix;
+	      
+	      f->id[of] = d->id;
+	      f->V[of2]=V[0];
+	      f->V[of2+1]=V[1];
+	      pix_count++;
+	      
+	      r2_pix = (x - d->x) * (x - d->x) + (y - d->y) * (y - d->y);
+	      if(r2_pix > rmax_pix)
+		rmax_pix = r2_pix;
+	      
+	      if(ftot && fpre) {
+		ftot->V[of2]   = fpre->V[of2  ] + f->V[of2];
+		ftot->V[of2+1] = fpre->V[of2+1] + f->V[of2+1];
+	      }
+	    }
+	  }
+	}
+      }
+      dc->pix[ i * dc->nproc + k ] = pix_count;
+      dc->r2 [ i * dc->nproc + k ] = rmax_pix;
+    }
+  }
+}
+
+/* Worker main loop -- never returns. */
+static void dc_child(WORLD *wld, DECOMP *dc, int k) {
+#ifdef __linux__
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+  for(;;) {
+    pthread_barrier_wait(&dc->ctl->start);
+    if(dc->ctl->cmd == DC_EXIT)
+      _exit(0);
+    dc_work(wld, dc, k);
+    fflush(stdout);
+    pthread_barrier_wait(&dc->ctl->done);
+  }
+}
+
+/* Allocate the scratch segment for <cap> corks and start the workers. */
+static int dc_start(WORLD *wld, long cap) {
+  DECOMP *dc = wld->dc;
+  pthread_barrierattr_t ba;
+  size_t ctl_len = (sizeof(DC_CTL) + 63) & ~(size_t)63;
+  char *mem;
+  int k;
+
+  dc->cap = cap;
+  dc->cmem_len = ctl_len + cap * ( sizeof(DC_CORK) + 2 * dc->nproc * sizeof(long) );
+  mem = (char *)dc_shm(dc->cmem_len);
+  if(!mem) 
+    return 1;
+  dc->cmem = mem;
+  dc->ctl = (DC_CTL *)mem;
+  dc->ck  = (DC_CORK *)(mem + ctl_len);
+  dc->pix = (long *)(dc->ck + cap);
+  dc->r2  = dc->pix + cap * dc->nproc;
+
+  pthread_barrierattr_init(&ba);
+  pthread_barrierattr_setpshared(&ba, PTHREAD_PROCESS_SHARED);
+  pthread_barrier_init(&dc->ctl->start, &ba, dc->nproc);
+  pthread_barrier_init(&dc->ctl->done,  &ba, dc->nproc);
+  pthread_barrierattr_destroy(&ba);
+
+  fflush(stdout);
+  fflush(stderr);
+  for(k=1; k<dc->nproc; k++) {
+    pid_t pid = fork();
+    if(pid == 0) 
+      dc_child(wld, dc, k);
+    if(pid < 0) {
+      // The barriers were set up for nproc workers, so kill off the 
+      // ones that did start and carry on in this process alone.
+      int got = k;
+      fprintf(stderr,"dc_start: fork failed after %d workers; running in one process\n",got);
+      for(k=1; k<got; k++) {
+	kill(dc->pids[k], SIGTERM);
+	waitpid(dc->pids[k], 0, 0);
+      }
+      pthread_barrier_destroy(&dc->ctl->start);
+      pthread_barrier_destroy(&dc->ctl->done);
+      munmap(dc->cmem, dc->cmem_len);
+      dc->cmem = 0;
+      dc->nproc = 1;
+      return dc_start(wld, cap);
+    }
+    dc->pids[k] = pid;
+  }
+  return 0;
+}
+
+/* Stop the workers and release the scratch segment. */
+static void dc_stop(WORLD *wld) {
+  DECOMP *dc = wld->dc;
+  int k;
+  if(!dc->cmem)
+    return;
+  dc->ctl->cmd = DC_EXIT;
+  pthread_barrier_wait(&dc->ctl->start);
+  for(k=1; k<dc->nproc; k++)
+    waitpid(dc->pids[k], 0, 0);
+  pthread_barrier_destroy(&dc->ctl->start);
+  pthread_barrier_destroy(&dc->ctl->done);
+  munmap(dc->cmem, dc->cmem_len);
+  dc->cmem = 0;
+}
+
+/* Run one command on all the workers (including this one) */
+static void dc_run(WORLD *wld, int cmd) {
+  DECOMP *dc = wld->dc;
+  dc->ctl->cmd = cmd;
+  pthread_barrier_wait(&dc->ctl->start);
+  dc_work(wld, dc, 0);
+  pthread_barrier_wait(&dc->ctl->done);
+}
+
+/* Make sure the scratch table can hold <n> corks.  The workers have
+ * the old segment mapped, so growing means restarting them.  */
+static int dc_ensure(WORLD *wld, long n) {
+  if(n <= wld->dc->cap)
+    return 0;
+  dc_stop(wld);
+  return dc_start(wld, n * 3 / 2 + 100);
+}
+
+/**********************************************************************
+ * decompose_world - switch a WORLD over to the multi-process engine.
+ * Returns 0 on success.  Call it after the parameters are set (update_params
+ * reallocates the fields).
+ */
+int decompose_world(WORLD *wld, int nproc) {
+  FIELD *fs[3];
+  size_t siz = wld->p->w * wld->p->h;
+  size_t flen = siz * ( 2 * sizeof(double) + sizeof(long) );
+  char *mem;
+  long cap;
+  int i;
+
+  if(wld->dc)
+    undecompose_world(wld);
+  if(nproc < 1)
+    nproc = 1;
+  wld->defer_shrinkers = 1;
+  if(nproc > wld->p->h)
+    nproc = wld->p->h;
+
+  fs[0] = wld->sg;
+  fs[1] = wld->g;
+  fs[2] = wld->tot;
+
+  // Move the fields into shared memory (before the fork, so the
+  // addresses are the same in all the workers).
+  mem = (char *)dc_shm( flen * 3 );
+  if(!mem) {
+    fprintf(stderr,"decompose_world: couldn't map %ld bytes of shared memory\n",(long)(flen*3));
+    return 1;
+  }
+  for(i=0;i<3;i++) {
+    double *V  = (double *)(mem + flen * i);
+    long   *id = (long *)(V + 2 * siz);
+    memcpy(V,  fs[i]->V,  sizeof(double) * siz * 2);
+    memcpy(id, fs[i]->id, sizeof(long) * siz);
+    free(fs[i]->V);
+    free(fs[i]->id);
+    fs[i]->V = V;
+    fs[i]->id = id;
+  }
+
+  wld->dc = (DECOMP *)calloc(1, sizeof(DECOMP));
+  wld->dc->nproc = nproc;
+  wld->dc->pids = (pid_t *)calloc(nproc, sizeof(pid_t));
+  wld->dc->fmem = mem;
+  wld->dc->fmem_len = flen * 3;
+
+  cap = wld->sgc->size;
+  if(wld->gc->size > cap) cap = wld->gc->size;
+  if(wld->mc->size > cap) cap = wld->mc->size;
+  if(dc_start(wld, cap)) {
+    fprintf(stderr,"decompose_world: couldn't start workers\n");
+    undecompose_world(wld);
+    return 1;
+  }
+  return 0;
+}
+
+/**********************************************************************
+ * undecompose_world - stop the workers and bring the fields back into
+ * ordinary memory.
+ */
+void undecompose_world(WORLD *wld) {
+  DECOMP *dc = wld->dc;
+  FIELD *fs[3];
+  size_t siz = wld->p->w * wld->p->h;
+  int i;
+
+  if(!dc)
+    return;
+  dc_stop(wld);
+
+  fs[0] = wld->sg;
+  fs[1] = wld->g;
+  fs[2] = wld->tot;
+  for(i=0;i<3;i++) {
+    double *V  = (double *) malloc(sizeof(double) * siz * 2);
+    long   *id = (long *)   malloc(sizeof(long)   * siz );
+    memcpy(V,  fs[i]->V,  sizeof(double) * siz * 2);
+    memcpy(id, fs[i]->id, sizeof(long) * siz);
+    fs[i]->V = V;
+    fs[i]->id = id;
+  }
+  munmap(dc->fmem, dc->fmem_len);
+  free(dc->pids);
+  free(dc);
+  wld->dc = 0;
+}
+
+/**********************************************************************
+ * update_field_dc - update_field for a decomposed WORLD.  Same arguments.
+ */
+void update_field_dc(WORLD *wld, CORKS *corks, FIELD *f, FIELD *fpre, FIELD *ftot, char *name) {
+  DECOMP *dc = wld->dc;
+  long i, k, passno;
+  long shrinkers;
+  long *sh;
+
+  printf("Processing %ss (%d workers)...\n",name,dc->nproc);
+  printf("advecting %ld %ss (maxn=%ld)\n",corks->maxn - corks->unused, name, corks->maxn);
+
+  if(dc_ensure(wld, corks->maxn)) {
+    fprintf(stderr,"update_field_dc: couldn't restart workers; finishing in one process\n");
+    undecompose_world(wld);
+    update_field(wld, corks, f, fpre, ftot, name);
+    return;
+  }
+
+  dc->ctl->which[0] = dc_which(wld, f);
+  dc->ctl->which[1] = dc_which(wld, fpre);
+  dc->ctl->which[2] = dc_which(wld, ftot);
+  dc->ctl->dt = wld->p->dt;
+  dc->ctl->dx = wld->p->dx;
+  dc->ctl->n = corks->maxn;
+
+  if(fpre) {
+    for(i=0;i<corks->maxn;i++) {
+      CORK *c = corks->array + i;
+      dc->ck[i].id = c->id;
+      dc->ck[i].x = c->x;
+      dc->ck[i].y = c->y;
+      dc->ck[i].out = 0;
+    }
+    dc_run(wld, DC_ADVECT);
+    for(i=0;i<corks->maxn;i++) {
+      CORK *c = corks->array + i;
+      if(c->id) {
+	c->x = dc->ck[i].x;
+	c->y = dc->ck[i].y;
+	if(dc->ck[i].out) {
+	  cork_died(wld, corks, c, CORKS_EV_EXIT);
+	  c->id = 0;
+	  corks->unused++;
+	}
+      }
+    }
+  }
+
+  if(f) {
+    sh = (long *)malloc( (corks->maxn + 1) * 5 * sizeof(long) );
+    passno = 0;
+    do {
+      shrinkers = 0;
+
+      printf("updating %ld %ss (maxn=%ld); pass %ld\n",corks->maxn - corks->unused, name, corks->maxn, passno);
+
+      for(i=0;i<corks->maxn;i++) {
+	CORK *c = corks->array + i;
+	DC_CORK *d = dc->ck + i;
+	d->id = c->id;
+	if(c->id) {
+	  d->x = c->x;
+	  d->y = c->y;
+	  cork_footprint(wld, corks, c, &d->div, &d->relage, d->box);
+	}
+      }
+      dc_run(wld, DC_PAINT);
+
+      // Gather the strips' results and find the shrinkers.  
+      for(i=0;i<corks->maxn;i++) {
+	CORK *c = corks->array + i;
+	DC_CORK *d = dc->ck + i;
+	long pix_count = 0;
+	long rmax_pix = 0;
+
+	if(!c->id)
+	  continue;
+	for(k=0;k<dc->nproc;k++) {
+	  pix_count += dc->pix[ i * dc->nproc + k ];
+	  if(dc->r2[ i * dc->nproc + k ] > rmax_pix)
+	    rmax_pix = dc->r2[ i * dc->nproc + k ];
+	}
+
+	c->rmax_pix = sqrt(rmax_pix);
+
+	if(pix_count > c->max_pixels)
+	  c->max_pixels = pix_count;
+
+	else if(pix_count < c->max_pixels / 4 || d->relage >= 1.5) {
+	  long *b = sh + shrinkers*5;
+	  b[0] = i;
+	  memcpy(b+1, d->box, 4*sizeof(long));
+	  shrinkers++;
+	}
+      }
+      remove_shrinkers(wld, corks, f, sh, shrinkers);
+      if(shrinkers && (passno==0)) 
+	printf("   found %ld shrinkers; repeating\n",shrinkers);
+    } while(shrinkers && (passno++)==0);
+    free(sh);
+  }
+}
+
+/**********************************************************************
+ * update_field_any - dispatch to the single- or multi-process updater.
+ */
+static void update_field_any(WORLD *wld, CORKS *corks, FIELD *f, FIELD *fpre, FIELD *ftot, char *name) {
+  if(wld->dc)
+    update_field_dc(wld, corks, f, fpre, ftot, name);
+  else
+    update_field(wld, corks, f, fpre, ftot, name);
+}
+
+/**********************************************************************
+ * set_extra_flow - copy in (or, with V==0, drop) a 2 x W x H flow field 
+ * to be added into the total flow.  It stays in force until replaced, so
+ * an evolving component should be set again before each step.
+ */
+void set_extra_flow(WORLD *wld, double *V) {
+  long siz = wld->p->w * wld->p->h;
+  if(!V) {
+    if(wld->extra)
+      free_field(wld->extra);
+    wld->extra = 0;
+    return;
+  }
+  if(!wld->extra)
+    wld->extra = new_field(wld->p->w, wld->p->h);
+  memcpy(wld->extra->V, V, sizeof(double) * siz * 2);
+}
+
+/**********************************************************************
+ * add_extra_flow - rebuild the total flow as supergranules + granules +
+ * the extra flow.  update_field only refreshes tot where granules repaint, 
+ * so with a time-varying extra component the whole field is recomputed.
+ */
+void add_extra_flow(WORLD *wld) {
+  long i;
+  long end = 2 * wld->p->w * wld->p->h;
+  double *tot = wld->tot->V;
+  double *sg = wld->sg->V;
+  double *g = wld->g->V;
+  double *ex = wld->extra->V;
+
+  for(i=0;i<end;i++) 
+    tot[i] = sg[i] + g[i] + ex[i];
+}
+
 /**********************************************************************
  * update_sim - advance the simulation by <n> dt time steps
  */
@@ -888,11 +1609,14 @@ void update_sim (WORLD *wld, long n_frames) {
 #if CORKS_DEBUG
     printf("sg..."); fflush(stdout);
 #endif
-    update_field(wld, wld->sgc, wld->sg, 0, 0, "supergranule");
+    update_field_any(wld, wld->sgc, wld->sg, 0, 0, "supergranule");
 #if CORKS_DEBUG
     printf("g..."); fflush(stdout);
 #endif
-    update_field(wld, wld->gc, wld->g, wld->sg, wld->tot, "granule");
+    update_field_any(wld, wld->gc, wld->g, wld->sg, wld->tot, "granule");
+
+    if(wld->extra)
+      add_extra_flow(wld);
 
 #if CORKS_DEBUG
     printf("pmc...");; fflush(stdout);
@@ -902,11 +1626,12 @@ void update_sim (WORLD *wld, long n_frames) {
 #if CORKS_DEBUG
     printf("mc..."); fflush(stdout);
 #endif
-    update_field(wld, wld->mc, 0, wld->tot, 0, "cork");
+    update_field_any(wld, wld->mc, 0, wld->tot, 0, "cork");
 #if CORKS_DEBUG
     printf("\n");
 #endif
   }
+  flush_event_log(wld);
 }
 
 
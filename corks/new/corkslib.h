@@ -2,6 +2,8 @@
  * Definitions for a corks model.
  */
 
+#include <stdio.h>
+
 
 /* FIELDs are variable-size and include a W x H (fast to slow) 
  * ID field and a 2 x W x H (fast to slow) velocity field.
@@ -55,6 +57,38 @@ typedef struct PARAMS {
 } PARAMS;
 
 
+/* Event log records, as written to disk (native byte order, after an 
+ * 8-byte "CORKSEV1" magic string).  x and y are in pixels.  parent is
+ * the cell of the next scale up at the event location (the supergranule
+ * for a granule, the granule for a magnetic cork or bipole), or 0.  */
+typedef struct CORKS_EVENT {
+  double t;
+  float x;
+  float y;
+  long long id;
+  long long parent;
+  int type;
+  int pad;
+} CORKS_EVENT;
+
+/* Event types.  Births, deaths and exits add a population code. */
+#define CORKS_POP_SG     0
+#define CORKS_POP_G      1
+#define CORKS_POP_MC     2
+#define CORKS_EV_BORN    1   /* 1-3: plonked or emerged                    */
+#define CORKS_EV_BIPOLE  4   /* id is the positive cork of the pair        */
+#define CORKS_EV_DIED    5   /* 5-7: shrank away, got too old, or removed  */
+#define CORKS_EV_EXIT    8   /* 8-10: advected out of the domain           */
+
+typedef struct EVLOG {
+  FILE *fp;
+  CORKS_EVENT *buf;
+  long n;
+  long size;
+} EVLOG;
+
+struct DECOMP;
+
 typedef struct WORLD {
   FIELD *sg;       /* supergranular flow field */
   FIELD *g;        /* granular flow field */
@@ -66,6 +100,10 @@ typedef struct WORLD {
   long next_label;
   long next_clabel;
   double t;        /* elapsed time */
+  struct DECOMP *dc; /* multi-process state (see decompose_world), or 0 */
+  EVLOG *ev;       /* event log, or 0 */
+  FIELD *extra;    /* extra flow added into tot each step (e.g. turbulence), or 0 */
+  int defer_shrinkers; /* delete shrinkers at the end of a pass (see update_field) */
 } WORLD;
 
   
@@ -89,6 +127,15 @@ void corks_crunch_and_grow(CORKS *cs);
 void corks_delete_cork(CORKS *cs, long pos);
 
 
+/******************************/
+/* event log */
+int open_event_log(WORLD *w, char *fname);
+void flush_event_log(WORLD *w);
+void close_event_log(WORLD *w);
+void corks_event(WORLD *w, int type, long id, double x, double y, long parent);
+long field_id_at(FIELD *f, double x, double y);
+int corks_pop(WORLD *w, CORKS *corks);
+
 /******************************/
 /* cork/granule/supergranule addition & removal */
 void new_mag_cork(WORLD *w, double x, double y, int negative);
@@ -109,6 +156,15 @@ int advect_cork( CORK *c, FIELD *field, double dt, double dx );
 
 /******************************/
 double div_flow( double flow_out[2], double div, double x_of, double y_of );
+void cork_footprint(WORLD *wld, CORKS *corks, CORK *c, double *div, double *relage, long box[4]);
 void update_field(WORLD *wld, CORKS *corks, FIELD *f, FIELD *fpre, FIELD *ftot, char *name);
+void set_extra_flow(WORLD *wld, double *V);
+void add_extra_flow(WORLD *wld);
 void update_sim(WORLD *wld, long n_frames);
 
+/******************************/
+/* multi-process (domain-decomposed) engine */
+int decompose_world(WORLD *wld, int nproc);
+void undecompose_world(WORLD *wld);
+void update_field_dc(WORLD *wld, CORKS *corks, FIELD *f, FIELD *fpre, FIELD *ftot, char *name);
+